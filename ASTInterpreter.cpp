@@ -3,19 +3,23 @@
 
 #include "clang/AST/ASTConsumer.h"
 #include "clang/AST/EvaluatedExprVisitor.h"
+#include "clang/Frontend/ASTUnit.h"
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/FrontendAction.h"
 #include "clang/Tooling/Tooling.h"
+#include <chrono>
 
 using namespace clang;
 
 #include "Environment.h"
+#include "LoopParallel.h"
 
 class InterpreterVisitor : 
    public EvaluatedExprVisitor<InterpreterVisitor> {
 public:
-   explicit InterpreterVisitor(const ASTContext &context, Environment * env)
-   : EvaluatedExprVisitor(context), mEnv(env) {}
+   explicit InterpreterVisitor(const ASTContext &context, Environment * env,
+                               LoopParallelizer * parallel = NULL)
+   : EvaluatedExprVisitor(context), mEnv(env), mParallel(parallel) {}
    virtual ~InterpreterVisitor() {}
 
    virtual void VisitBinaryOperator (BinaryOperator * bop) {
@@ -53,6 +57,7 @@ public:
        }
    }
    virtual void VisitForStmt(ForStmt * forstmt){
+     if (mParallel && mParallel->run(forstmt, *mEnv)) return;
      for(forstmt->getInit();Visit(forstmt->getCond()),mEnv->getcond(forstmt->getCond());Visit(forstmt->getInc())){
            VisitStmt(forstmt->getBody());
        }
@@ -87,41 +92,289 @@ public:
 
 private:
    Environment * mEnv;
+   LoopParallelizer * mParallel;   /// Set only on the top-level visitor, chunks run sequentially
+};
+
+/// Run main() of the translation unit in \p env. Returns false with the
+/// reason in \p error if the run was stopped by a runtime error or for
+/// going over its memory budget.
+static bool interpret(ASTContext & context, Environment & env, std::string & error,
+                      LoopParallelizer * parallel = NULL) {
+   InterpreterVisitor visitor(context, &env, parallel);
+   try {
+       env.init(context.getTranslationUnitDecl());
+       for (const GlobalInit & global : env.getGlobalInits()) {
+           visitor.Visit(global.init);
+           env.initGlobal(global);
+       }
+
+       FunctionDecl * entry = env.getEntry();
+       try{
+            visitor.VisitStmt(entry->getBody());
+       }catch(ReturnException &e){}
+   } catch (InterpreterError &e) {
+       error = e.what();
+       return false;
+   } catch (OutOfMemoryException &e) {
+       int64_t limit = env.getBudget()->limit();
+       error = "out of memory";
+       if (limit) error += ", the run exceeded its limit of " + std::to_string(limit) + " bytes";
+       return false;
+   } catch (BadAllocationSizeException &e) {
+       error = "cannot allocate " + std::to_string(e.bytes()) + " bytes";
+       return false;
+   }
+   return true;
+}
+
+static void reportMemory(const MemoryBudget & budget) {
+   llvm::errs() << "memory high-water marks (bytes):";
+   for (int c = 0; c < MEM_NumCategories; ++ c)
+       llvm::errs() << " " << MemoryBudget::name((MemCategory)c) << " " << budget.peak((MemCategory)c);
+   llvm::errs() << ", total " << budget.peak() << "\n";
+}
+
+/// Command line settings shared by the frontend actions
+struct InterpreterOptions {
+   Tracer * tracer;                   /// --trace FILE
+   std::deque<int64_t> * replay;      /// --replay FILE
+   TraceReader * decode;              /// --decode FILE
+   unsigned threads;                  /// --threads N, run independent loops on N cores
+   MemoryBudget * budget;             /// --mem-limit BYTES
+   InterpreterOptions() : tracer(NULL), replay(NULL), decode(NULL), threads(1), budget(NULL) {}
 };
 
 class InterpreterConsumer : public ASTConsumer {
 public:
-   explicit InterpreterConsumer(const ASTContext& context) : mEnv(),
-   	   mVisitor(context, &mEnv) {
+   explicit InterpreterConsumer(const InterpreterOptions & opts) : mEnv(opts.budget), mThreads(opts.threads) {
+       mEnv.setTracer(opts.tracer);
+       mEnv.setReplay(opts.replay);
    }
    virtual ~InterpreterConsumer() {}
 
    virtual void HandleTranslationUnit(clang::ASTContext &Context) {
-	   TranslationUnitDecl * decl = Context.getTranslationUnitDecl();
-	   mEnv.init(decl);
-
-	   FunctionDecl * entry = mEnv.getEntry();
-       try{
-	        mVisitor.VisitStmt(entry->getBody());
-       }catch(ReturnException &e){}
+       /// A trace or replay must see every event in order, so stay sequential
+       bool finished;
+       std::string error;
+       if (mThreads <= 1 || mEnv.isTracing()) {
+           finished = interpret(Context, mEnv, error);
+       } else {
+           LoopParallelizer parallel(mThreads, [&Context](Environment & env, Stmt * body) {
+               InterpreterVisitor visitor(Context, &env);
+               visitor.VisitStmt(body);
+           });
+           finished = interpret(Context, mEnv, error, &parallel);
+       }
+       /// On stdout, like the remainder warning of division, so a run's
+       /// diagnostics stay on one stream
+       if (!finished)
+           printf("Error: %s\n", error.c_str());
   }
 private:
    Environment mEnv;
-   InterpreterVisitor mVisitor;
+   unsigned mThreads;
+};
+
+/// Turns a binary trace back into source-level events. The program is
+/// parsed again so the raw locations in the trace resolve to line:column.
+class TraceDecodeConsumer : public ASTConsumer {
+public:
+   explicit TraceDecodeConsumer(const TraceReader & reader) : mReader(reader) {}
+
+   virtual void HandleTranslationUnit(clang::ASTContext &Context) {
+       SourceManager & sm = Context.getSourceManager();
+       std::map<uint32_t, std::string> functions;
+       TranslationUnitDecl * unit = Context.getTranslationUnitDecl();
+       for (auto i = unit->decls_begin(), e = unit->decls_end(); i != e; ++ i)
+           if (FunctionDecl * fdecl = dyn_cast<FunctionDecl>(*i))
+               functions[fdecl->getBeginLoc().getRawEncoding()] = fdecl->getNameAsString();
+
+       if (mReader.wrapped())
+           llvm::outs() << "# trace wrapped, " << mReader.begin() << " oldest records lost\n";
+       for (uint64_t i = mReader.begin(), e = mReader.end(); i != e; ++ i) {
+           const TraceRecord & r = mReader.at(i);
+           PresumedLoc ploc = sm.getPresumedLoc(SourceLocation::getFromRawEncoding(r.loc));
+           if (ploc.isValid())
+               llvm::outs() << ploc.getLine() << ":" << ploc.getColumn() << " ";
+           else
+               llvm::outs() << "?:? ";
+           switch (r.kind) {
+               case TR_Stmt:   llvm::outs() << "stmt"; break;
+               case TR_Call:   llvm::outs() << "call " << functions[(uint32_t)r.a]; break;
+               case TR_Return: llvm::outs() << "return " << r.a; break;
+               case TR_Malloc: llvm::outs() << "MALLOC " << r.a << " -> " << (void *)r.b; break;
+               case TR_Free:   llvm::outs() << "FREE " << (void *)r.a << " (" << r.b << ")"; break;
+               case TR_Print:  llvm::outs() << "PRINT " << r.a; break;
+               case TR_Get:    llvm::outs() << "GET " << r.a; break;
+               default:        llvm::outs() << "unknown record " << r.kind; break;
+           }
+           llvm::outs() << "\n";
+       }
+   }
+private:
+   const TraceReader & mReader;
 };
 
 class InterpreterClassAction : public ASTFrontendAction {
 public: 
+  explicit InterpreterClassAction(const InterpreterOptions & opts) : mOpts(opts) {}
+
   virtual std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(
     clang::CompilerInstance &Compiler, llvm::StringRef InFile) {
+    if (mOpts.decode)
+        return std::unique_ptr<clang::ASTConsumer>(new TraceDecodeConsumer(*mOpts.decode));
     return std::unique_ptr<clang::ASTConsumer>(
-        new InterpreterConsumer(Compiler.getASTContext()));
+        new InterpreterConsumer(mOpts));
   }
+private:
+  InterpreterOptions mOpts;
 };
 
+/// Each session worker thread parses its own copy of the program; the AST is
+/// then only read, while all mutable run state lives in the Environment.
+static SessionServer::RunnerFactory sessionRunner(const std::string & code, int64_t memLimit) {
+   return [code, memLimit]() {
+       static std::mutex parseLock;
+       std::shared_ptr<ASTUnit> ast;
+       {
+           std::lock_guard<std::mutex> guard(parseLock);
+           ast = clang::tooling::buildASTFromCode(code);
+       }
+       return std::function<void(Session &)>([ast, memLimit](Session & session) {
+           MemoryBudget budget(memLimit);
+           Environment env(&budget);
+           env.setSession(&session);
+           std::string error;
+           if (!interpret(ast->getASTContext(), env, error))
+               session.write("\nError: " + error + "\n");
+       });
+   };
+}
+
+/// Byte count with an optional K, M or G suffix
+static int64_t parseSize(const char * value) {
+   char * suffix;
+   int64_t size = strtoll(value, &suffix, 10);
+   if (*suffix == 'K' || *suffix == 'k') size <<= 10;
+   else if (*suffix == 'M' || *suffix == 'm') size <<= 20;
+   else if (*suffix == 'G' || *suffix == 'g') size <<= 30;
+   return size;
+}
+
+/// Usage: ast-interpreter CODE [--trace FILE [--trace-size N]] [--replay FILE] [--decode FILE]
+///                             [--serve SOCKET | --stress N [--stress-rounds R]] [--workers N]
+///                             [--session-stack BYTES[K|M|G]]
+///                             [--threads N] [--mem-limit BYTES[K|M|G]] [--mem-stats]
+///
+/// --threads runs for loops that are provably free of cross-iteration
+/// dependences on N cores (see LoopParallelizer).
+///
+/// --mem-limit caps the memory of a run (of each session when serving);
+/// going over it ends the run with exit status 3. --mem-stats reports the
+/// high-water mark of each allocation category.
+///
+/// --serve runs one session of CODE per connection on a unix socket, GET
+/// reading integers from and PRINT writing to the connection. --stress runs
+/// N sessions over socketpairs, each sent R inputs, and reports throughput.
+/// --session-stack sets the stack of each session (default 8M), which bounds
+/// how deep an interpreted program may recurse.
 int main (int argc, char ** argv) {
    if (argc > 1) {
+       InterpreterOptions opts;
+       Tracer tracer;
+       TraceReader replay, decode;
+       std::deque<int64_t> inputs;
+       const char * tracePath = NULL;
+       uint64_t traceSize = 1 << 20;
+       const char * servePath = NULL;
+       unsigned stress = 0, stressRounds = 1, workers = 4;
+       size_t sessionStack = Fiber::DefaultStackSize;
+       int64_t memLimit = 0;
+       bool memStats = false;
+       for (int i = 2; i < argc; ++ i) {
+           std::string flag(argv[i]);
+           if (flag == "--mem-stats") {
+               memStats = true;
+               continue;
+           }
+           if (i + 1 == argc) {
+               llvm::errs() << "Error: option " << flag << " needs a value\n";
+               return 1;
+           }
+           const char * value = argv[++ i];
+           if (flag == "--trace") {
+               tracePath = value;
+           } else if (flag == "--serve") {
+               servePath = value;
+           } else if (flag == "--stress") {
+               stress = strtoul(value, NULL, 10);
+           } else if (flag == "--stress-rounds") {
+               stressRounds = strtoul(value, NULL, 10);
+           } else if (flag == "--threads") {
+               opts.threads = strtoul(value, NULL, 10);
+           } else if (flag == "--mem-limit") {
+               memLimit = parseSize(value);
+           } else if (flag == "--session-stack") {
+               sessionStack = parseSize(value);
+           } else if (flag == "--workers") {
+               workers = strtoul(value, NULL, 10);
+           } else if (flag == "--trace-size") {
+               traceSize = strtoull(value, NULL, 10);
+           } else if (flag == "--replay") {
+               if (!replay.open(value)) {
+                   llvm::errs() << "Error: cannot read trace " << value << "\n";
+                   return 1;
+               }
+               if (!replay.inputsComplete()) {
+                   llvm::errs() << "Error: trace " << value << " lost GET values, cannot replay\n";
+                   return 1;
+               }
+               inputs = replay.inputs();
+               opts.replay = &inputs;
+           } else if (flag == "--decode") {
+               if (!decode.open(value)) {
+                   llvm::errs() << "Error: cannot read trace " << value << "\n";
+                   return 1;
+               }
+               opts.decode = &decode;
+           } else {
+               llvm::errs() << "Error: unknown option " << flag << "\n";
+               return 1;
+           }
+       }
+       if (servePath) {
+           SessionServer server(sessionRunner(argv[1], memLimit), workers, sessionStack);
+           if (!server.listen(servePath)) {
+               llvm::errs() << "Error: cannot listen on " << servePath << "\n";
+               return 1;
+           }
+           for (;;) pause();
+       }
+       if (stress) {
+           auto start = std::chrono::steady_clock::now();
+           SessionServer server(sessionRunner(argv[1], memLimit), workers, sessionStack);
+           std::vector<std::string> outputs = stressSessions(server, stress, stressRounds);
+           server.stop();
+           double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+           unsigned same = 0;
+           for (auto & out : outputs) same += (out == outputs[0]);
+           llvm::errs() << outputs.size() << " sessions on " << workers << " threads, peak "
+               << server.peak() << " concurrent, " << secs << "s; "
+               << same << " outputs match the first: " << (outputs.empty() ? "" : outputs[0]) << "\n";
+           return same == stress ? 0 : 1;
+       }
+       if (tracePath) {
+           if (!tracer.open(tracePath, traceSize)) {
+               llvm::errs() << "Error: cannot create trace " << tracePath << "\n";
+               return 1;
+           }
+           opts.tracer = &tracer;
+       }
+       MemoryBudget budget(memLimit);
+       opts.budget = &budget;
        //runToolOnCode 
-       clang::tooling::runToolOnCode(std::unique_ptr<clang::FrontendAction>(new InterpreterClassAction), argv[1]);
+       clang::tooling::runToolOnCode(std::unique_ptr<clang::FrontendAction>(new InterpreterClassAction(opts)), argv[1]);
+       if (memStats) reportMemory(budget);
+       if (budget.exhausted()) return 3;
    }
 }
@@ -1,5 +1,7 @@
 //==--- tools/clang-check/ClangInterpreter.cpp - Clang Interpreter tool --------------===//
 //===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_ENVIRONMENT_H
+#define AST_INTERPRETER_ENVIRONMENT_H
 #include <stdio.h>
 
 #include "clang/AST/ASTConsumer.h"
@@ -8,21 +10,78 @@
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/FrontendAction.h"
 #include "clang/Tooling/Tooling.h"
+#include "llvm/ADT/DenseMap.h"
 #include <exception>
+#include <deque>
+#include "Trace.h"
+#include "Session.h"
+#include "MemoryBudget.h"
 using namespace std;
 using namespace clang;
 
 class ReturnException : public std::exception{};
+/// A runtime error in the interpreted program; ends the run, not the process
+class InterpreterError : public std::exception {
+   std::string mMessage;
+public:
+   explicit InterpreterError(const std::string & message) : mMessage(message) {}
+   virtual const char * what() const noexcept {
+       return mMessage.c_str();
+   }
+};
 class StackFrame {
+   typedef std::map<Decl*, int64_t, std::less<Decl*>,
+                    AccountingAllocator<std::pair<Decl* const, int64_t> > > VarMap;
+   typedef std::map<Stmt*, int64_t, std::less<Stmt*>,
+                    AccountingAllocator<std::pair<Stmt* const, int64_t> > > ExprMap;
+   typedef std::map<Decl*, void *, std::less<Decl*>,
+                    AccountingAllocator<std::pair<Decl* const, void *> > > ArrayMap;
    /// StackFrame maps Variable Declaration to Value
    /// Which are either integer or addresses (also represented using an Integer value)
-   std::map<Decl*, int64_t> mVars;
-   std::map<Stmt*, int64_t> mExprs;
+   VarMap mVars;
+   ExprMap mExprs;
+   /// Local arrays declared in this frame by declaration, released with it
+   ArrayMap mArrays;
+   MemoryBudget * mBudget;
    /// The current stmt
    Stmt * mPC;
    int64_t retValue;
 public:
-   StackFrame() : mVars(), mExprs(), mPC() {
+   explicit StackFrame(MemoryBudget * budget = NULL)
+       : mVars(std::less<Decl*>(), VarMap::allocator_type(budget, MEM_Frames)),
+         mExprs(std::less<Stmt*>(), ExprMap::allocator_type(budget, MEM_Exprs)),
+         mArrays(std::less<Decl*>(), ArrayMap::allocator_type(budget, MEM_Frames)), mBudget(budget), mPC() {
+   }
+   /// A copy shares the parent's arrays but does not own them
+   StackFrame(const StackFrame & other)
+       : mVars(other.mVars), mExprs(other.mExprs), mArrays(other.mArrays.get_allocator()),
+         mBudget(other.mBudget), mPC(other.mPC), retValue(other.retValue) {
+   }
+   StackFrame(StackFrame && other) noexcept
+       : mVars(std::move(other.mVars)), mExprs(std::move(other.mExprs)), mArrays(std::move(other.mArrays)),
+         mBudget(other.mBudget), mPC(other.mPC), retValue(other.retValue) {
+       other.mArrays.clear();
+   }
+   StackFrame & operator=(const StackFrame &) = delete;
+   ~StackFrame() {
+       for (auto & array : mArrays)
+           mBudget->freeBlock(MEM_Arrays, array.second);
+   }
+
+   /// Zeroed array of \p length 64-bit elements for \p decl, freed when the
+   /// frame is popped. Running the same DeclStmt again, e.g. in a loop body,
+   /// re-zeroes the block \p decl already has instead of allocating another.
+   int64_t allocArray(Decl * decl, int64_t length) {
+       size_t bytes = length * sizeof(int64_t);
+       void *& array = mArrays[decl];
+       if (array && MemoryBudget::blockSize(array) == bytes) {
+           memset(array, 0, bytes);
+           return (int64_t)array;
+       }
+       mBudget->freeBlock(MEM_Arrays, array);
+       array = NULL;
+       array = mBudget->allocateBlock(MEM_Arrays, bytes);
+       return (int64_t)array;
    }
 
    void bindDecl(Decl* decl, int64_t val) {
@@ -53,8 +112,64 @@ public:
    }
 };
 
+/// DataSegment holds every file-scope variable in one contiguous block of
+/// 64-bit slots. Offsets are fixed by layout() before execution starts, so
+/// a global is read or written with one indexed access from any function.
+/// Arrays take one slot per element and evaluate to the address of their
+/// first slot.
+class DataSegment {
+   std::vector<int64_t, AccountingAllocator<int64_t> > mSlots;
+   llvm::DenseMap<const Decl *, unsigned> mOffsets;
+public:
+   explicit DataSegment(MemoryBudget * budget) : mSlots(AccountingAllocator<int64_t>(budget, MEM_Globals)) {
+   }
+
+   /// Number of slots a file-scope variable needs, 0 if it is unsupported
+   static unsigned slotsFor(const VarDecl * vardecl) {
+       const Type * type = vardecl->getType().getTypePtr();
+       if (type->isIntegerType() || type->isPointerType())
+           return 1;
+       if (auto array = dyn_cast<ConstantArrayType>(type))
+           return array->getSize().getZExtValue();
+       return 0;
+   }
+
+   /// Assign offsets to \p globals and zero the segment, as C does.
+   /// Redeclarations share the slots of their canonical declaration.
+   void layout(const std::vector<VarDecl *> & globals) {
+       unsigned size = 0;
+       for (VarDecl * vardecl : globals) {
+           const Decl * canon = vardecl->getCanonicalDecl();
+           if (mOffsets.count(canon)) continue;
+           unsigned slots = 0;
+           for (const VarDecl * redecl : vardecl->redecls())
+               slots = std::max(slots, slotsFor(redecl));
+           mOffsets[canon] = size;
+           size += slots;
+       }
+       mSlots.assign(size, 0);
+   }
+
+   /// The slot of \p decl, or NULL if it is not a global
+   int64_t * slot(const Decl * decl) {
+       auto it = mOffsets.find(decl->getCanonicalDecl());
+       return it == mOffsets.end() ? NULL : &mSlots[it->second];
+   }
+};
+
+/// One data segment slot whose initializer is evaluated before main runs
+struct GlobalInit {
+   VarDecl * decl;
+   Expr * init;
+   unsigned index;      /// Element index for array initializers
+};
+
 class Environment {
-   std::vector<StackFrame> mStack;
+   std::unique_ptr<MemoryBudget> mOwnBudget;
+   MemoryBudget * mBudget;              /// Every allocation of the run is charged here
+   std::vector<StackFrame, AccountingAllocator<StackFrame> > mStack;
+   std::shared_ptr<DataSegment> mGlobals;  /// Shared with Environments forked for parallel loops
+   std::vector<GlobalInit> mGlobalInits;  /// Global slots whose initializer is not a literal
 
    FunctionDecl * mFree;				/// Declartions to the built-in functions
    FunctionDecl * mMalloc;
@@ -62,15 +177,90 @@ class Environment {
    FunctionDecl * mOutput;
 
    FunctionDecl * mEntry;
+
+   Tracer * mTracer;                    /// Optional binary trace of the run
+   std::deque<int64_t> * mReplay;       /// GET values fed back when replaying a trace
+   Session * mSession;                  /// Socket session doing GET/PRINT, may suspend in GET
+
+   void setPC(Stmt * stmt) {
+       mStack.back().setPC(stmt);
+       if (mTracer) mTracer->emit(TR_Stmt, stmt->getBeginLoc().getRawEncoding());
+   }
+   void trace(TraceKind kind, Stmt * stmt, int64_t a = 0, int64_t b = 0) {
+       if (mTracer) mTracer->emit(kind, stmt->getBeginLoc().getRawEncoding(), a, b);
+   }
+
+   /// Data segment slot of a file-scope variable, NULL for locals
+   int64_t * globalSlot(Decl * decl) {
+       VarDecl * vardecl = dyn_cast<VarDecl>(decl);
+       return vardecl && vardecl->hasGlobalStorage() ? mGlobals->slot(decl) : NULL;
+   }
+   int64_t loadDecl(Decl * decl) {
+       if (int64_t * slot = globalSlot(decl))
+           return cast<VarDecl>(decl)->getType()->isArrayType() ? (int64_t)slot : *slot;
+       return mStack.back().getDeclVal(decl);
+   }
+
+   /// Store a literal initializer of slot \p index of \p vardecl right away,
+   /// or queue it to be evaluated before main
+   void initSlot(VarDecl * vardecl, Expr * init, unsigned index) {
+       Expr * value = init->IgnoreImpCasts();
+       int64_t * slot = mGlobals->slot(vardecl) + index;
+       if (auto literal = dyn_cast<IntegerLiteral>(value))
+           *slot = literal->getValue().getSExtValue();
+       else if (auto literal = dyn_cast<CharacterLiteral>(value))
+           *slot = literal->getValue();
+       else if (isa<ImplicitValueInitExpr>(value))
+           *slot = 0;
+       else if (isa<InitListExpr>(value))
+           throw InterpreterError("unsupported initializer of global " + vardecl->getName().str());
+       else
+           mGlobalInits.push_back(GlobalInit{vardecl, init, index});
+   }
+   void storeDecl(Decl * decl, int64_t val) {
+       if (int64_t * slot = globalSlot(decl)) *slot = val;
+       else mStack.back().bindDecl(decl, val);
+   }
 public:
    /// Get the declartions to the built-in functions
-   Environment() : mStack(), mFree(NULL), mMalloc(NULL), mInput(NULL), mOutput(NULL), mEntry(NULL) {
+   /// Without a \p budget the run is accounted but not capped
+   explicit Environment(MemoryBudget * budget = NULL)
+       : mOwnBudget(budget ? NULL : new MemoryBudget()), mBudget(budget ? budget : mOwnBudget.get()),
+       mStack(AccountingAllocator<StackFrame>(mBudget, MEM_Frames)),
+       mGlobals(std::make_shared<DataSegment>(mBudget)), mFree(NULL), mMalloc(NULL),
+       mInput(NULL), mOutput(NULL), mEntry(NULL), mTracer(NULL), mReplay(NULL), mSession(NULL) {
+   }
+
+   /// Environment that runs a chunk of a parallel loop on another thread.
+   /// It shares the data segment and built-ins with \p parent and starts from
+   /// a copy of the parent's current frame; tracing and I/O are not inherited.
+   Environment(const Environment & parent, const StackFrame & frame)
+       : mBudget(parent.mBudget), mStack(AccountingAllocator<StackFrame>(mBudget, MEM_Frames)),
+       mGlobals(parent.mGlobals), mFree(parent.mFree), mMalloc(parent.mMalloc),
+       mInput(parent.mInput), mOutput(parent.mOutput), mEntry(parent.mEntry),
+       mTracer(NULL), mReplay(NULL), mSession(NULL) {
+       mStack.push_back(frame);
+   }
+
+   MemoryBudget * getBudget() {
+       return mBudget;
+   }
+
+   void setTracer(Tracer * tracer) {
+       mTracer = tracer;
+   }
+   void setReplay(std::deque<int64_t> * inputs) {
+       mReplay = inputs;
+   }
+   void setSession(Session * session) {
+       mSession = session;
    }
 
 
    /// Initialize the Environment
    void init(TranslationUnitDecl * unit) {
-	   mStack.push_back(StackFrame());
+	   mStack.push_back(StackFrame(mBudget));
+       std::vector<VarDecl *> globals;
 	   for (TranslationUnitDecl::decl_iterator i =unit->decls_begin(), e = unit->decls_end(); i != e; ++ i) {
 		   if (FunctionDecl * fdecl = dyn_cast<FunctionDecl>(*i) ) {
 			   if (fdecl->getName().equals("FREE")) mFree = fdecl;
@@ -80,24 +270,66 @@ public:
 			   else if (fdecl->getName().equals("main")) mEntry = fdecl;
 		   }else{
              if(VarDecl * vardecl = dyn_cast<VarDecl>(*i)){
-			   if(vardecl->getType().getTypePtr()->isIntegerType() ||vardecl->getType().getTypePtr()->isCharType()){
-                   if(vardecl->hasInit()) {
-                       if (auto literal = dyn_cast<IntegerLiteral>(vardecl->getInit())){
-                           intliteral(literal); 
-                           mStack.back().bindDecl(vardecl, literal->getValue().getSExtValue());
-                       }
-                   }
-                    else mStack.back().bindDecl(vardecl, 0);
-                }
-               }
+               if(DataSegment::slotsFor(vardecl) > 0) globals.push_back(vardecl);
+             }
            }
 	   }
+       mGlobals->layout(globals);
+       for (VarDecl * vardecl : globals) {
+           if (!vardecl->hasInit()) continue;
+           if (!vardecl->getType()->isArrayType()) {
+               initSlot(vardecl, vardecl->getInit(), 0);
+               continue;
+           }
+           /// Elements past the initializer stay zero, as C does
+           unsigned slots = DataSegment::slotsFor(vardecl);
+           Expr * init = vardecl->getInit()->IgnoreImpCasts();
+           if (auto list = dyn_cast<InitListExpr>(init)) {
+               for (unsigned i = 0; i < list->getNumInits() && i < slots; ++ i)
+                   initSlot(vardecl, list->getInit(i), i);
+           } else if (auto string = dyn_cast<StringLiteral>(init)) {
+               int64_t * slot = mGlobals->slot(vardecl);
+               for (unsigned i = 0; i < string->getLength() && i < slots; ++ i)
+                   slot[i] = string->getCodeUnit(i);
+           } else {
+               throw InterpreterError("unsupported initializer of global " + vardecl->getName().str());
+           }
+       }
+   }
+
+   /// Globals whose initializers must be evaluated before main runs, in
+   /// declaration order
+   const std::vector<GlobalInit> & getGlobalInits() {
+       return mGlobalInits;
+   }
+   /// Store the already evaluated initializer of \p global
+   void initGlobal(const GlobalInit & global) {
+       mGlobals->slot(global.decl)[global.index] = mStack.back().getStmtVal(global.init);
    }
 
    FunctionDecl * getEntry() {
 	   return mEntry;
    }
 
+   /// True for GET, PRINT, MALLOC and FREE
+   bool isBuiltin(const FunctionDecl * fdecl) {
+       return fdecl == mInput || fdecl == mOutput || fdecl == mMalloc || fdecl == mFree;
+   }
+   bool isTracing() {
+       return mTracer || mReplay;
+   }
+
+   StackFrame & frame() {
+       return mStack.back();
+   }
+   /// Current value of a variable, local or global
+   int64_t getDeclVal(Decl * decl) {
+       return loadDecl(decl);
+   }
+   void setDeclVal(Decl * decl, int64_t val) {
+       storeDecl(decl, val);
+   }
+
    /// !TODO Support comparison operation
    int64_t binop(BinaryOperator *bop) {
 	   Expr * left = bop->getLHS();
@@ -111,7 +343,7 @@ public:
                if(DeclRefExpr *declExpr = dyn_cast<DeclRefExpr>(left)){
                    mStack.back().bindStmt(left, rightVal);
                    Decl *decl = declExpr->getFoundDecl();
-                   mStack.back().bindDecl(decl, rightVal);
+                   storeDecl(decl, rightVal);
                }else if(auto array = dyn_cast<ArraySubscriptExpr>(left)){
                    int64_t base = mStack.back().getStmtVal(array->getLHS()->IgnoreImpCasts()),
                            offset = mStack.back().getStmtVal(array->getRHS()->IgnoreImpCasts());
@@ -136,8 +368,11 @@ public:
                mStack.back().bindStmt(bop, val = leftVal * rightVal);
                break;
             case BO_Div:
-               rightVal==0?printf("Error:number cannot be divided by zero\n"),exit(0):(void)0;
-               leftVal%rightVal==0?0:printf("Warning: number is not divided with no remainder\n");
+               if (rightVal == 0) throw InterpreterError("number cannot be divided by zero");
+               if (leftVal % rightVal != 0) {
+                   if (mSession) mSession->write("Warning: number is not divided with no remainder\n");
+                   else printf("Warning: number is not divided with no remainder\n");
+               }
                mStack.back().bindStmt(bop, val = int64_t(leftVal/rightVal));
                break;
             case BO_LT:
@@ -168,20 +403,9 @@ public:
                     else mStack.back().bindDecl(vardecl, 0);
                }else{
                    if(auto array = dyn_cast<ConstantArrayType>(vardecl->getType().getTypePtr())){
+                       /// Every element takes 8 bytes, matching arraysub()
                        int length = array->getSize().getSExtValue();
-                       if(array->getElementType().getTypePtr()->isIntegerType()){
-                           int * int_array = new int[length];
-                           for(int i=0; i<length; int_array[i++]=0);
-                           mStack.back().bindDecl(vardecl, (int64_t)int_array);
-                       }else if(array->getElementType().getTypePtr()->isCharType()){
-                           char * char_array = new char[length];
-                           for(int i=0; i<length; char_array[i++]=0);
-                           mStack.back().bindDecl(vardecl, (int64_t)char_array);
-                       }else{
-                           int64_t ** ptr_array = new int64_t*[length];
-                           for(int i=0; i<length; ptr_array[i++]=0);
-                           mStack.back().bindDecl(vardecl, (int64_t)ptr_array);
-                       }
+                       mStack.back().bindDecl(vardecl, mStack.back().allocArray(vardecl, length));
                    }
                }
 		   }
@@ -189,12 +413,12 @@ public:
    }
 
    int64_t declref(DeclRefExpr * declref) {
-	   mStack.back().setPC(declref);
+	   setPC(declref);
        auto type = declref->getType();
 	   mStack.back().bindStmt(declref, 0);//for MALLOC function, it is a declrefexpr but it was not bound
        if (type->isIntegerType() || type->isPointerType() || type->isArrayType()) {
 		   Decl* decl = declref->getFoundDecl();
-		   int64_t val = mStack.back().getDeclVal(decl);
+		   int64_t val = loadDecl(decl);
 		   mStack.back().bindStmt(declref, val);
            return val;
 	   }
@@ -208,36 +432,54 @@ public:
 
    /// !TODO Support Function Call
    void call(CallExpr * callexpr, int hasInitStack) {
-       mStack.back().setPC(callexpr);
+       setPC(callexpr);
        int64_t val = 0;
        FunctionDecl * callee = callexpr->getDirectCallee();
       if (hasInitStack==0){
            if (callee == mInput) {
-              llvm::errs() << "Please Input an Integer Value : ";
-              scanf("%d", &val);
+              if (mReplay) {
+                  if (mReplay->empty()) throw InterpreterError("replay trace has no more GET values");
+                  val = mReplay->front();
+                  mReplay->pop_front();
+              } else if (mSession) {
+                  val = mSession->readInt();
+              } else {
+                  llvm::errs() << "Please Input an Integer Value : ";
+                  scanf("%d", &val);
+              }
+              trace(TR_Get, callexpr, val);
+              if (mTracer) mTracer->input(val);
 
               mStack.back().bindStmt(callexpr, val);
            } else if (callee == mOutput) {
                Expr * decl = callexpr->getArg(0);
                val = mStack.back().getStmtVal(decl);
-               llvm::errs() << val << " ";
+               trace(TR_Print, callexpr, val);
+               if (mSession) mSession->write(std::to_string(val) + " ");
+               else llvm::errs() << val << " ";
            } else if (callee == mMalloc){
                /// You could add your code here for Function call Return
                int size = mStack.back().getStmtVal(callexpr->getArg(0));
-               int64_t *p = (int64_t *)malloc(size);
+               if (size < 0) throw InterpreterError("MALLOC of negative size " + std::to_string(size));
+               int64_t *p = (int64_t *)mBudget->allocateBlock(MEM_Heap, size);
+               trace(TR_Malloc, callexpr, size, (int64_t)p);
                mStack.back().bindStmt(callexpr, (int64_t)p);
            }else if (callee == mFree){
-               std::free( (int64_t *) (mStack.back().getStmtVal(callexpr->getArg(0))) );
+               int64_t p = mStack.back().getStmtVal(callexpr->getArg(0));
+               trace(TR_Free, callexpr, p, p ? MemoryBudget::blockSize((void *) p) : 0);
+               mBudget->freeBlock(MEM_Heap, (void *) p);
            }else{
+               trace(TR_Call, callexpr, callee->getBeginLoc().getRawEncoding());
                vector<int64_t> args;
                for (auto i=callexpr->arg_begin(), e=callexpr->arg_end(); i!=e; args.push_back(mStack.back().getStmtVal(*(i++))));
-               mStack.push_back(StackFrame());
+               mStack.push_back(StackFrame(mBudget));
                int j = 0;
                for (auto i=callee->param_begin(), e=callee->param_end(); i!=e; i++,j++)
                    mStack.back().bindDecl(*i, args[j]);
                }
        }else{
            int64_t retvalue = mStack.back().getRetValue();
+           trace(TR_Return, callexpr, retvalue);
            mStack.pop_back();
            mStack.back().bindStmt(callexpr, retvalue);
        }
@@ -287,4 +529,4 @@ public:
    }
 };
 
-
+#endif
@@ -0,0 +1,401 @@
+//==--- LoopParallel.h - Parallel execution of dependence-free for loops --===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_LOOPPARALLEL_H
+#define AST_INTERPRETER_LOOPPARALLEL_H
+
+#include <algorithm>
+#include <exception>
+#include <map>
+#include <set>
+
+#include "Environment.h"
+#include "ThreadPool.h"
+
+/// coeff * i + constant + sum(scale * var), where i is the induction
+/// variable and every var is loop invariant
+struct AffineExpr {
+   int64_t coeff;
+   int64_t constant;
+   std::map<VarDecl *, int64_t> terms;
+
+   AffineExpr() : coeff(0), constant(0) {}
+
+   bool operator==(const AffineExpr & other) const {
+      return coeff == other.coeff && constant == other.constant && terms == other.terms;
+   }
+   void add(const AffineExpr & other, int64_t scale) {
+      coeff += scale * other.coeff;
+      constant += scale * other.constant;
+      for (auto & term : other.terms) terms[term.first] += scale * term.second;
+   }
+   bool isConstant() const {
+      if (coeff != 0) return false;
+      for (auto & term : terms) if (term.second != 0) return false;
+      return true;
+   }
+   /// The part that does not depend on i, at loop entry
+   int64_t invariant(Environment & env) const {
+      int64_t val = constant;
+      for (auto & term : terms) val += term.second * env.getDeclVal(term.first);
+      return val;
+   }
+};
+
+struct ArrayAccess {
+   VarDecl * base;
+   Expr * index;
+   AffineExpr affine;
+   bool write;
+};
+
+/// What the analysis found out about one ForStmt
+struct ParallelLoop {
+   bool parallel;
+   VarDecl * induction;
+   int64_t step;
+   AffineExpr bound;                     /// i < bound (step > 0) or i > bound (step < 0)
+   std::vector<ArrayAccess> accesses;    /// accesses to arrays that outlive an iteration
+   std::vector<std::pair<VarDecl *, BinaryOperatorKind>> reductions;
+   ParallelLoop() : parallel(false), induction(NULL), step(0) {}
+};
+
+/// Runs counted ForStmt loops on a work-stealing pool when it can prove
+/// that iterations are independent:
+///  - the loop is `for (...; i < n; i = i + c)` (or `>` with a negative
+///    step) with n loop invariant;
+///  - the body writes arrays only as base[a*i + b] with a != 0 and uses the
+///    same index for every other access to that base;
+///  - scalars assigned in the body are declared in it, or are reductions
+///    `s = s + e` / `s = s * e` that read s nowhere else;
+///  - there is no GET, PRINT, MALLOC, FREE, division, pointer dereference
+///    or return, and every called function is pure.
+/// The induction variable starts from its value at loop entry, as in
+/// InterpreterVisitor::VisitForStmt.
+/// Distinct array bases may still alias, so their address ranges are
+/// checked for overlap at loop entry before going parallel.
+class LoopParallelizer {
+public:
+   /// Visits a loop body in the given Environment
+   typedef std::function<void(Environment &, Stmt *)> BodyRunner;
+
+private:
+   /// What one walk over a loop body collects
+   struct Scan {
+      bool ok;
+      std::set<VarDecl *> locals;
+      std::map<VarDecl *, std::vector<BinaryOperator *>> writes;
+      std::map<VarDecl *, unsigned> reads;
+      std::vector<ArrayAccess> accesses;
+      Scan() : ok(true) {}
+   };
+
+   WorkStealingPool mPool;
+   BodyRunner mRunBody;
+   std::map<ForStmt *, ParallelLoop> mLoops;
+   std::map<FunctionDecl *, bool> mPure;
+
+   static VarDecl * refVar(Expr * expr) {
+      if (auto ref = dyn_cast<DeclRefExpr>(expr->IgnoreParenImpCasts()))
+         return dyn_cast<VarDecl>(ref->getDecl());
+      return NULL;
+   }
+
+   /// Walk the loop body and record everything it reads and writes
+   void scan(Stmt * stmt, Environment & env, Scan & s) {
+      if (!stmt || !s.ok) return;
+      if (auto bop = dyn_cast<BinaryOperator>(stmt)) {
+         if (bop->isAssignmentOp()) {
+            Expr * lhs = bop->getLHS()->IgnoreParens();
+            if (bop->getOpcode() != BO_Assign) {
+               s.ok = false;
+            } else if (auto ref = dyn_cast<DeclRefExpr>(lhs)) {
+               VarDecl * var = dyn_cast<VarDecl>(ref->getDecl());
+               if (var) s.writes[var].push_back(bop);
+               else s.ok = false;
+            } else if (auto array = dyn_cast<ArraySubscriptExpr>(lhs)) {
+               access(array, true, env, s);
+            } else {
+               s.ok = false;
+            }
+            scan(bop->getRHS(), env, s);
+            return;
+         }
+         /// Environment::binop can fail or print on division
+         if (bop->getOpcode() == BO_Div) s.ok = false;
+      } else if (auto unary = dyn_cast<UnaryOperator>(stmt)) {
+         /// Environment::unaryexpr treats every operator but minus as a dereference
+         if (unary->getOpcode() != UO_Minus) s.ok = false;
+      } else if (auto array = dyn_cast<ArraySubscriptExpr>(stmt)) {
+         access(array, false, env, s);
+         return;
+      } else if (auto ref = dyn_cast<DeclRefExpr>(stmt)) {
+         if (VarDecl * var = dyn_cast<VarDecl>(ref->getDecl())) ++ s.reads[var];
+      } else if (auto call = dyn_cast<CallExpr>(stmt)) {
+         FunctionDecl * callee = call->getDirectCallee();
+         if (!callee || env.isBuiltin(callee) || !isPure(callee, env)) s.ok = false;
+      } else if (auto declstmt = dyn_cast<DeclStmt>(stmt)) {
+         for (auto it = declstmt->decl_begin(), ie = declstmt->decl_end(); it != ie; ++ it)
+            if (VarDecl * var = dyn_cast<VarDecl>(*it)) s.locals.insert(var);
+      } else if (isa<ReturnStmt>(stmt) || isa<BreakStmt>(stmt) || isa<ContinueStmt>(stmt) ||
+                 isa<GotoStmt>(stmt) || isa<LabelStmt>(stmt)) {
+         s.ok = false;
+      }
+      for (Stmt * child : stmt->children()) scan(child, env, s);
+   }
+
+   void access(ArraySubscriptExpr * array, bool write, Environment & env, Scan & s) {
+      VarDecl * base = refVar(array->getLHS());
+      if (!base) {
+         s.ok = false;
+         return;
+      }
+      ArrayAccess a;
+      a.base = base;
+      a.index = array->getRHS();
+      a.write = write;
+      s.accesses.push_back(a);
+      scan(array->getRHS(), env, s);
+   }
+
+   /// A function is pure if it only computes on its own locals: no array
+   /// or pointer accesses, no global writes, no division and no built-ins. Only the
+   /// outermost query is cached, since recursive calls are assumed pure
+   /// while their caller is still being checked.
+   bool isPure(FunctionDecl * fdecl, Environment & env) {
+      auto it = mPure.find(fdecl);
+      if (it != mPure.end()) return it->second;
+      std::set<FunctionDecl *> visiting;
+      bool pure = pureFunction(fdecl, env, visiting);
+      mPure[fdecl] = pure;
+      return pure;
+   }
+   bool pureFunction(FunctionDecl * fdecl, Environment & env, std::set<FunctionDecl *> & visiting) {
+      auto it = mPure.find(fdecl);
+      if (it != mPure.end()) return it->second;
+      if (visiting.count(fdecl)) return true;
+      if (!fdecl->hasBody() || env.isBuiltin(fdecl)) return false;
+      visiting.insert(fdecl);
+      return pureStmt(fdecl->getBody(), env, visiting);
+   }
+   bool pureStmt(Stmt * stmt, Environment & env, std::set<FunctionDecl *> & visiting) {
+      if (!stmt) return true;
+      if (auto bop = dyn_cast<BinaryOperator>(stmt)) {
+         if (bop->isAssignmentOp()) {
+            VarDecl * var = refVar(bop->getLHS());
+            if (bop->getOpcode() != BO_Assign || !var || var->hasGlobalStorage()) return false;
+         }
+         if (bop->getOpcode() == BO_Div) return false;
+      } else if (auto unary = dyn_cast<UnaryOperator>(stmt)) {
+         if (unary->getOpcode() != UO_Minus) return false;
+      } else if (isa<ArraySubscriptExpr>(stmt)) {
+         return false;
+      } else if (auto call = dyn_cast<CallExpr>(stmt)) {
+         FunctionDecl * callee = call->getDirectCallee();
+         if (!callee || !pureFunction(callee, env, visiting)) return false;
+      }
+      for (Stmt * child : stmt->children())
+         if (!pureStmt(child, env, visiting)) return false;
+      return true;
+   }
+
+   /// Parse \p expr as an affine function of \p induction, with every other
+   /// variable required to be in \p invariant
+   bool affine(Expr * expr, VarDecl * induction, const std::function<bool(VarDecl *)> & invariant,
+               AffineExpr & result) {
+      expr = expr->IgnoreParenImpCasts();
+      if (auto literal = dyn_cast<IntegerLiteral>(expr)) {
+         result.constant = literal->getValue().getSExtValue();
+         return true;
+      }
+      if (VarDecl * var = refVar(expr)) {
+         if (var == induction) result.coeff = 1;
+         else if (invariant(var) && var->getType()->isIntegerType()) result.terms[var] = 1;
+         else return false;
+         return true;
+      }
+      if (auto unary = dyn_cast<UnaryOperator>(expr)) {
+         AffineExpr sub;
+         if (unary->getOpcode() != UO_Minus || !affine(unary->getSubExpr(), induction, invariant, sub))
+            return false;
+         result.add(sub, -1);
+         return true;
+      }
+      if (auto bop = dyn_cast<BinaryOperator>(expr)) {
+         AffineExpr left, right;
+         if (!affine(bop->getLHS(), induction, invariant, left) ||
+             !affine(bop->getRHS(), induction, invariant, right))
+            return false;
+         switch (bop->getOpcode()) {
+            case BO_Add:
+               result.add(left, 1);
+               result.add(right, 1);
+               return true;
+            case BO_Sub:
+               result.add(left, 1);
+               result.add(right, -1);
+               return true;
+            case BO_Mul:
+               if (left.isConstant()) result.add(right, left.constant);
+               else if (right.isConstant()) result.add(left, right.constant);
+               else return false;
+               return true;
+            default:
+               return false;
+         }
+      }
+      return false;
+   }
+
+   /// Decide whether \p forstmt can run in parallel
+   ParallelLoop analyze(ForStmt * forstmt, Environment & env) {
+      ParallelLoop loop;
+
+      /// Induction variable and step: i = i + c, i = c + i or i = i - c
+      auto inc = dyn_cast_or_null<BinaryOperator>(forstmt->getInc());
+      if (!inc || inc->getOpcode() != BO_Assign) return loop;
+      VarDecl * induction = refVar(inc->getLHS());
+      auto next = dyn_cast<BinaryOperator>(inc->getRHS()->IgnoreParenImpCasts());
+      if (!induction || induction->hasGlobalStorage() || !induction->getType()->isIntegerType() || !next)
+         return loop;
+      IntegerLiteral * literal = NULL;
+      if (refVar(next->getLHS()) == induction)
+         literal = dyn_cast<IntegerLiteral>(next->getRHS()->IgnoreParenImpCasts());
+      else if (next->getOpcode() == BO_Add && refVar(next->getRHS()) == induction)
+         literal = dyn_cast<IntegerLiteral>(next->getLHS()->IgnoreParenImpCasts());
+      if (!literal || (next->getOpcode() != BO_Add && next->getOpcode() != BO_Sub)) return loop;
+      int64_t step = literal->getValue().getSExtValue();
+      if (next->getOpcode() == BO_Sub) step = -step;
+      if (step == 0) return loop;
+
+      Scan s;
+      scan(forstmt->getBody(), env, s);
+      if (!s.ok) return loop;
+      auto invariant = [&](VarDecl * var) {
+         return var != induction && !s.writes.count(var) && !s.locals.count(var);
+      };
+
+      /// Condition: i < bound counting up, i > bound counting down
+      auto cond = dyn_cast_or_null<BinaryOperator>(forstmt->getCond());
+      if (!cond || refVar(cond->getLHS()) != induction ||
+          (!(cond->getOpcode() == BO_LT && step > 0) && !(cond->getOpcode() == BO_GT && step < 0)))
+         return loop;
+      if (!affine(cond->getRHS(), induction, invariant, loop.bound) || loop.bound.coeff != 0)
+         return loop;
+
+      /// Scalars written in the body must be private to it or reductions
+      for (auto & write : s.writes) {
+         VarDecl * var = write.first;
+         if (s.locals.count(var)) continue;
+         if (var == induction || var->hasGlobalStorage() || !var->getType()->isIntegerType() ||
+             write.second.size() != 1 || s.reads[var] != 1)
+            return loop;
+         auto rhs = dyn_cast<BinaryOperator>(write.second[0]->getRHS()->IgnoreParenImpCasts());
+         if (!rhs || (rhs->getOpcode() != BO_Add && rhs->getOpcode() != BO_Mul) ||
+             (refVar(rhs->getLHS()) != var && refVar(rhs->getRHS()) != var))
+            return loop;
+         loop.reductions.push_back(std::make_pair(var, rhs->getOpcode()));
+      }
+
+      /// Each written array is touched at a single index a*i + b, a != 0
+      std::map<VarDecl *, const ArrayAccess *> written;
+      for (ArrayAccess & a : s.accesses) {
+         /// Arrays declared in the body are fresh every iteration; local
+         /// pointers are not, they may point anywhere and fail invariant()
+         if (s.locals.count(a.base) && a.base->getType()->isArrayType()) continue;
+         if (!invariant(a.base) || !affine(a.index, induction, invariant, a.affine)) return loop;
+         loop.accesses.push_back(a);
+      }
+      for (ArrayAccess & a : loop.accesses)
+         if (a.write) {
+            if (a.affine.coeff == 0) return loop;
+            written[a.base] = &a;
+         }
+      for (ArrayAccess & a : loop.accesses)
+         if (written.count(a.base) && !(written[a.base]->affine == a.affine)) return loop;
+
+      loop.parallel = true;
+      loop.induction = induction;
+      loop.step = step;
+      return loop;
+   }
+
+   /// Byte range [first, last) touched by \p a over \p trip iterations from \p lo
+   static std::pair<int64_t, int64_t> range(const ArrayAccess & a, Environment & env,
+                                            int64_t lo, int64_t step, int64_t trip) {
+      int64_t base = env.getDeclVal(a.base), inv = a.affine.invariant(env);
+      int64_t first = a.affine.coeff * lo + inv;
+      int64_t last = a.affine.coeff * (lo + (trip - 1) * step) + inv;
+      return std::make_pair(base + 8 * std::min(first, last), base + 8 * std::max(first, last) + 8);
+   }
+
+public:
+   LoopParallelizer(unsigned threads, BodyRunner runBody) : mPool(threads), mRunBody(runBody) {
+   }
+
+   /// Run \p forstmt in parallel if it is provably free of cross-iteration
+   /// dependences. Returns false if the caller must run it sequentially.
+   bool run(ForStmt * forstmt, Environment & env) {
+      auto found = mLoops.find(forstmt);
+      if (found == mLoops.end())
+         found = mLoops.insert(std::make_pair(forstmt, analyze(forstmt, env))).first;
+      ParallelLoop & loop = found->second;
+      if (!loop.parallel) return false;
+
+      int64_t lo = env.getDeclVal(loop.induction), hi = loop.bound.invariant(env), step = loop.step;
+      int64_t trip = 0;
+      if (step > 0 && lo < hi) trip = (hi - lo + step - 1) / step;
+      if (step < 0 && lo > hi) trip = (lo - hi - step - 1) / -step;
+      unsigned threads = mPool.size();
+      if (trip < 2 * (int64_t)threads) return false;
+
+      /// Different bases may point into the same block
+      for (const ArrayAccess & w : loop.accesses) {
+         if (!w.write) continue;
+         auto wr = range(w, env, lo, step, trip);
+         for (const ArrayAccess & a : loop.accesses) {
+            if (a.base == w.base) continue;
+            auto ar = range(a, env, lo, step, trip);
+            if (ar.first < wr.second && wr.first < ar.second) return false;
+         }
+      }
+
+      int64_t chunks = std::min<int64_t>(trip, 4 * threads);
+      std::vector<std::vector<int64_t>> partials(chunks);
+      std::vector<std::exception_ptr> errors(chunks);
+      std::vector<std::function<void()>> tasks;
+      Stmt * body = forstmt->getBody();
+      for (int64_t c = 0; c < chunks; ++ c) {
+         int64_t from = trip * c / chunks, to = trip * (c + 1) / chunks;
+         tasks.push_back([&, c, from, to]() {
+            try {
+               Environment worker(env, env.frame());
+               for (auto & red : loop.reductions)
+                  worker.setDeclVal(red.first, red.second == BO_Add ? 0 : 1);
+               for (int64_t k = from; k < to; ++ k) {
+                  worker.setDeclVal(loop.induction, lo + k * step);
+                  mRunBody(worker, body);
+               }
+               for (auto & red : loop.reductions)
+                  partials[c].push_back(worker.getDeclVal(red.first));
+            } catch (...) {
+               errors[c] = std::current_exception();
+            }
+         });
+      }
+      mPool.run(tasks);
+      for (auto & error : errors)
+         if (error) std::rethrow_exception(error);
+
+      for (size_t r = 0; r < loop.reductions.size(); ++ r) {
+         VarDecl * var = loop.reductions[r].first;
+         int64_t val = env.getDeclVal(var);
+         for (auto & partial : partials)
+            val = loop.reductions[r].second == BO_Add ? val + partial[r] : val * partial[r];
+         env.setDeclVal(var, val);
+      }
+      env.setDeclVal(loop.induction, lo + trip * step);
+      return true;
+   }
+};
+
+#endif
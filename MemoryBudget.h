@@ -0,0 +1,169 @@
+//==--- MemoryBudget.h - Per-run memory accounting for the interpreter ----===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_MEMORYBUDGET_H
+#define AST_INTERPRETER_MEMORYBUDGET_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <new>
+
+/// What an interpreter allocation is for
+enum MemCategory {
+   MEM_Frames,      /// StackFrame variable maps and the frame stack
+   MEM_Exprs,       /// StackFrame expression value caches
+   MEM_Arrays,      /// Local arrays declared with DeclStmt
+   MEM_Globals,     /// The data segment
+   MEM_Heap,        /// Blocks handed out by MALLOC
+   MEM_NumCategories
+};
+
+/// Thrown when an allocation would take a run over its memory cap
+class OutOfMemoryException : public std::exception{};
+
+/// Thrown for a block size no allocation could satisfy. The program is at
+/// fault, not the budget, so the run is not marked as exhausted.
+class BadAllocationSizeException : public std::exception {
+   size_t mBytes;
+public:
+   explicit BadAllocationSizeException(size_t bytes) : mBytes(bytes) {}
+   size_t bytes() const {
+      return mBytes;
+   }
+};
+
+/// Counts every byte a run allocates, per category, against an optional
+/// hard cap. Counters are atomic because chunks of a parallel loop charge
+/// the budget of the run they belong to from several threads.
+class MemoryBudget {
+   int64_t mLimit;                                  /// 0 means no cap
+   std::atomic<int64_t> mTotal;
+   std::atomic<int64_t> mTotalPeak;
+   std::atomic<int64_t> mCurrent[MEM_NumCategories];
+   std::atomic<int64_t> mPeak[MEM_NumCategories];
+   std::atomic<bool> mExhausted;
+
+   static void raise(std::atomic<int64_t> & peak, int64_t val) {
+      for (int64_t old = peak; val > old && !peak.compare_exchange_weak(old, val); );
+   }
+
+   /// Blocks from allocateBlock() carry their size in front, rounded to
+   /// keep the payload 16-byte aligned
+   static const size_t BlockHeader = 16;
+public:
+   explicit MemoryBudget(int64_t limit = 0) : mLimit(limit), mTotal(0), mTotalPeak(0), mExhausted(false) {
+      for (int c = 0; c < MEM_NumCategories; ++ c) {
+         mCurrent[c] = 0;
+         mPeak[c] = 0;
+      }
+   }
+
+   static const char * name(MemCategory category) {
+      static const char * names[MEM_NumCategories] = {"frames", "exprs", "arrays", "globals", "heap"};
+      return names[category];
+   }
+
+   /// Account for \p bytes, throwing OutOfMemoryException over the cap
+   void charge(MemCategory category, size_t bytes) {
+      int64_t total = mTotal += bytes;
+      if (mLimit && total > mLimit) {
+         mTotal -= bytes;
+         mExhausted = true;
+         throw OutOfMemoryException();
+      }
+      raise(mTotalPeak, total);
+      raise(mPeak[category], mCurrent[category] += bytes);
+   }
+   void release(MemCategory category, size_t bytes) {
+      mTotal -= bytes;
+      mCurrent[category] -= bytes;
+   }
+
+   void * allocate(MemCategory category, size_t bytes, bool zeroed = false) {
+      charge(category, bytes);
+      void * p = zeroed ? calloc(1, bytes) : malloc(bytes);
+      if (!p) {
+         release(category, bytes);
+         mExhausted = true;
+         throw OutOfMemoryException();
+      }
+      return p;
+   }
+   void deallocate(MemCategory category, void * p, size_t bytes) {
+      free(p);
+      release(category, bytes);
+   }
+
+   /// Zeroed block whose size is remembered, so freeBlock() needs only the
+   /// pointer. calloc() gets large blocks as fresh zero pages, so a big
+   /// MALLOC costs resident memory only for the pages the program touches.
+   void * allocateBlock(MemCategory category, size_t bytes) {
+      /// A byte count that wrapped, e.g. an overflowing array length; MALLOC
+      /// rejects negative sizes before they get here
+      if (bytes > (size_t)INT64_MAX / 2)
+         throw BadAllocationSizeException(bytes);
+      char * p = (char *)allocate(category, bytes + BlockHeader, true);
+      *(size_t *)p = bytes;
+      return p + BlockHeader;
+   }
+   /// Size requested for a block from allocateBlock()
+   static size_t blockSize(void * block) {
+      return *(size_t *)((char *)block - BlockHeader);
+   }
+   void freeBlock(MemCategory category, void * block) {
+      if (!block) return;
+      char * p = (char *)block - BlockHeader;
+      deallocate(category, p, *(size_t *)p + BlockHeader);
+   }
+
+   int64_t limit() const {
+      return mLimit;
+   }
+   bool exhausted() const {
+      return mExhausted;
+   }
+   int64_t peak(MemCategory category) const {
+      return mPeak[category];
+   }
+   int64_t peak() const {
+      return mTotalPeak;
+   }
+};
+
+/// std allocator that charges a MemoryBudget. With no budget it falls back
+/// to plain operator new, so containers can still be default constructed.
+template <class T>
+class AccountingAllocator {
+public:
+   typedef T value_type;
+
+   MemoryBudget * mBudget;
+   MemCategory mCategory;
+
+   AccountingAllocator() : mBudget(NULL), mCategory(MEM_Frames) {}
+   AccountingAllocator(MemoryBudget * budget, MemCategory category) : mBudget(budget), mCategory(category) {}
+   template <class U>
+   AccountingAllocator(const AccountingAllocator<U> & other) : mBudget(other.mBudget), mCategory(other.mCategory) {}
+
+   T * allocate(size_t n) {
+      if (!mBudget) return (T *)::operator new(n * sizeof(T));
+      return (T *)mBudget->allocate(mCategory, n * sizeof(T));
+   }
+   void deallocate(T * p, size_t n) {
+      if (!mBudget) ::operator delete(p);
+      else mBudget->deallocate(mCategory, p, n * sizeof(T));
+   }
+
+   template <class U>
+   bool operator==(const AccountingAllocator<U> & other) const {
+      return mBudget == other.mBudget && mCategory == other.mCategory;
+   }
+   template <class U>
+   bool operator!=(const AccountingAllocator<U> & other) const {
+      return !(*this == other);
+   }
+};
+
+#endif
@@ -0,0 +1,459 @@
+//==--- Session.h - Interactive sessions multiplexed on a few threads -----===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_SESSION_H
+#define AST_INTERPRETER_SESSION_H
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+/// Thrown inside a session when GET needs input but the peer has closed,
+/// or when PRINT has output for a peer that has gone away
+class SessionClosedException : public std::exception{};
+
+/// A stackful coroutine. The interpreter is a recursive AST visitor, so
+/// GET must be able to suspend from arbitrarily deep inside it; a separate
+/// stack per session lets it do that without changing the visitor.
+class Fiber {
+   ucontext_t mContext;
+   ucontext_t mCaller;
+   void * mStack;
+   size_t mStackSize;
+   std::function<void()> mBody;
+   bool mDone;
+
+   /// An exception cannot unwind past the first frame of a fiber's stack,
+   /// so anything the body lets through is logged here and ends the fiber
+   static void trampoline(unsigned hi, unsigned lo) {
+      Fiber * self = (Fiber *)(((uintptr_t)hi << 32) | (uintptr_t)lo);
+      try {
+         self->mBody();
+      } catch (std::exception & e) {
+         fprintf(stderr, "Error: fiber ended by an exception: %s\n", e.what());
+      } catch (...) {
+         fprintf(stderr, "Error: fiber ended by an unknown exception\n");
+      }
+      self->mDone = true;
+      swapcontext(&self->mContext, &self->mCaller);
+   }
+public:
+   /// Same as a default main thread stack, since the interpreter recurses
+   /// as deep as the program does (and more so at -O0). Stacks are reserved
+   /// with MAP_NORESERVE, so thousands of fibers still cost little memory.
+   static const size_t DefaultStackSize = 8 * 1024 * 1024;
+
+   Fiber(std::function<void()> body, size_t stackSize = DefaultStackSize)
+      : mStack(NULL), mStackSize(stackSize), mBody(body), mDone(false) {
+      mStack = mmap(NULL, mStackSize, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+      if (mStack == MAP_FAILED) throw std::bad_alloc();
+      /// Guard page at the low end catches stack overflow
+      mprotect(mStack, 4096, PROT_NONE);
+      getcontext(&mContext);
+      mContext.uc_stack.ss_sp = mStack;
+      mContext.uc_stack.ss_size = mStackSize;
+      mContext.uc_link = NULL;
+      uintptr_t self = (uintptr_t)this;
+      makecontext(&mContext, (void (*)())trampoline, 2,
+                  (unsigned)(self >> 32), (unsigned)(self & 0xffffffffu));
+   }
+   ~Fiber() {
+      munmap(mStack, mStackSize);
+   }
+   Fiber(const Fiber &) = delete;
+   Fiber & operator=(const Fiber &) = delete;
+
+   /// Run the fiber until it yields or finishes
+   void resume() {
+      swapcontext(&mCaller, &mContext);
+   }
+   /// Called from inside the fiber to return control to resume()'s caller
+   void yield() {
+      swapcontext(&mContext, &mCaller);
+   }
+   bool done() const {
+      return mDone;
+   }
+};
+
+/// One interactive run connected to a socket. GET and PRINT go through the
+/// session; when GET finds no complete integer buffered the session's fiber
+/// yields back to its worker's event loop until more input arrives.
+class Session {
+   int mFd;
+   std::string mIn;
+   size_t mInPos;
+   std::string mOut;
+   bool mEof;
+   bool mWaiting;
+   bool mWriting;                       /// write() is waiting for the peer to take output
+   bool mThrottled;                     /// fill() stopped at MaxInput with data left unread
+   bool mBroken;                        /// the peer can no longer take output
+   Fiber mFiber;
+
+   /// Run the session's program. A closed peer ends it quietly; any other
+   /// failure is reported to the peer and the log instead of being lost.
+   void run(const std::function<void(Session &)> & body) {
+      std::string error;
+      try {
+         body(*this);
+      } catch (SessionClosedException &) {
+      } catch (std::bad_alloc &) {
+         error = "out of memory";
+      } catch (std::exception & e) {
+         error = e.what();
+      } catch (...) {
+         error = "unknown exception";
+      }
+      if (error.empty()) return;
+      fprintf(stderr, "Error: session on fd %d failed: %s\n", mFd, error.c_str());
+      if (!mBroken) mOut += "\nError: " + error + "\n";
+   }
+public:
+   /// Unconsumed input buffered per session; the rest waits in the socket
+   static const size_t MaxInput = 64 * 1024;
+   /// Unsent output buffered per session before PRINT waits for the peer
+   static const size_t MaxOutput = 64 * 1024;
+
+   Session(int fd, std::function<void(Session &)> body, size_t stackSize = Fiber::DefaultStackSize)
+      : mFd(fd), mInPos(0), mEof(false), mWaiting(false), mWriting(false), mThrottled(false), mBroken(false),
+        mFiber([this, body]() { run(body); }, stackSize) {
+   }
+   ~Session() {
+      ::close(mFd);
+   }
+
+   int fd() const {
+      return mFd;
+   }
+
+   /// Read the next integer, suspending until one is available. Characters
+   /// that cannot start an integer are skipped; a '-' that ends the buffer
+   /// is kept, since its digits may arrive in the next read.
+   int64_t readInt() {
+      for (;;) {
+         while (mInPos < mIn.size() && !isdigit((unsigned char)mIn[mInPos]) &&
+                !(mIn[mInPos] == '-' && (mInPos + 1 < mIn.size() ?
+                                         isdigit((unsigned char)mIn[mInPos + 1]) : !mEof)))
+            ++ mInPos;
+         size_t end = mInPos + (mInPos < mIn.size() && mIn[mInPos] == '-');
+         while (end < mIn.size() && isdigit((unsigned char)mIn[end])) ++ end;
+         /// A number at the end of the buffer may continue in the next read,
+         /// unless the buffer is already full
+         if (mInPos < mIn.size() && (end < mIn.size() || mEof || mIn.size() - mInPos >= MaxInput)) {
+            int64_t val = strtoll(mIn.c_str() + mInPos, NULL, 10);
+            mInPos = end;
+            if (mInPos == mIn.size()) {
+               mIn.clear();
+               mInPos = 0;
+            }
+            return val;
+         }
+         if (mEof) throw SessionClosedException();
+         /// Edge-triggered epoll will not report data fill() left behind
+         if (mThrottled) {
+            fill();
+            continue;
+         }
+         mWaiting = true;
+         mFiber.yield();
+         mWaiting = false;
+      }
+   }
+
+   /// Queue \p text for the peer. Past MaxOutput unsent bytes the fiber
+   /// sends what it can and yields until the peer takes the rest, so a run
+   /// that prints without reading cannot buffer without bound. Throws
+   /// SessionClosedException once the peer has gone away, so the run ends
+   /// instead of printing into nothing.
+   void write(const std::string & text) {
+      if (mBroken) throw SessionClosedException();
+      mOut += text;
+      if (mOut.size() < MaxOutput) return;
+      flush();
+      while (mOut.size() >= MaxOutput) {
+         mWriting = true;
+         mFiber.yield();
+         mWriting = false;
+      }
+      if (mBroken) throw SessionClosedException();
+   }
+
+   /// Pull what is readable from the socket, up to MaxInput unconsumed bytes
+   void fill() {
+      char buf[4096];
+      if (mInPos > 0) {
+         mIn.erase(0, mInPos);
+         mInPos = 0;
+      }
+      mThrottled = false;
+      for (;;) {
+         if (mIn.size() >= MaxInput) {
+            mThrottled = true;
+            return;
+         }
+         ssize_t n = ::read(mFd, buf, std::min(sizeof(buf), MaxInput - mIn.size()));
+         if (n > 0) {
+            mIn.append(buf, n);
+         } else if (n == 0) {
+            mEof = true;
+            return;
+         } else {
+            if (errno != EAGAIN && errno != EINTR) mEof = true;
+            if (errno != EINTR) return;
+         }
+      }
+   }
+
+   /// Event loop side: write buffered output, true once all of it is sent.
+   /// MSG_NOSIGNAL turns a peer that disconnected early into EPIPE instead of
+   /// a SIGPIPE that would kill every session of the server.
+   bool flush() {
+      while (!mOut.empty()) {
+         ssize_t n = ::send(mFd, mOut.data(), mOut.size(), MSG_NOSIGNAL);
+         if (n > 0) {
+            mOut.erase(0, n);
+         } else if (n < 0 && errno == EINTR) {
+            continue;
+         } else {
+            if (n < 0 && errno != EAGAIN) {
+               mOut.clear();
+               mBroken = true;
+            }
+            break;
+         }
+      }
+      return mOut.empty();
+   }
+
+   void resume() {
+      mFiber.resume();
+   }
+   bool waiting() const {
+      return mWaiting;
+   }
+   bool writing() const {
+      return mWriting;
+   }
+   /// Event loop side: send what the peer takes, true once write() may go on
+   bool drained() {
+      flush();
+      return mOut.size() < MaxOutput;
+   }
+   bool done() const {
+      return mFiber.done();
+   }
+};
+
+/// Runs sessions on a small fixed set of threads. Each worker owns an epoll
+/// instance and the sessions assigned to it, so a session never migrates
+/// between threads and its interpreter state needs no locking.
+class SessionServer {
+public:
+   /// Called once on each worker thread; returns the function that runs
+   /// one session on that thread (e.g. bound to a per-thread AST)
+   typedef std::function<std::function<void(Session &)>()> RunnerFactory;
+
+private:
+   struct Worker {
+      int epoll;
+      int wake;                        /// eventfd signalled when pending grows
+      std::mutex lock;
+      std::vector<int> pending;
+      std::thread thread;
+   };
+
+   RunnerFactory mFactory;
+   size_t mStackSize;
+   std::vector<std::unique_ptr<Worker>> mWorkers;
+   std::atomic<unsigned> mNext;
+   std::atomic<bool> mStopping;
+   std::atomic<long> mActive;
+   std::atomic<long> mPeak;
+   int mListen;
+
+   /// Run a new session up to its first GET; false if it already ended
+   bool start(Worker & w, Session * s) {
+      s->resume();
+      if (finish(w, s)) return false;
+      epoll_event ev;
+      ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+      ev.data.ptr = s;
+      epoll_ctl(w.epoll, EPOLL_CTL_ADD, s->fd(), &ev);
+      return true;
+   }
+
+   /// Flush output and tear the session down once its run has ended
+   bool finish(Worker & w, Session * s) {
+      bool flushed = s->flush();
+      if (!s->done() || !flushed) return false;
+      epoll_ctl(w.epoll, EPOLL_CTL_DEL, s->fd(), NULL);
+      delete s;
+      -- mActive;
+      return true;
+   }
+
+   void loop(Worker & w) {
+      std::function<void(Session &)> runner = mFactory();
+      epoll_event events[256];
+      while (!mStopping || mActive > 0) {
+         int n = epoll_wait(w.epoll, events, 256, 100);
+         for (int i = 0; i < n; ++ i) {
+            void * tag = events[i].data.ptr;
+            if (tag == &w) {
+               uint64_t count;
+               if (::read(w.wake, &count, sizeof(count)) < 0) {}
+               std::vector<int> fds;
+               {
+                  std::lock_guard<std::mutex> guard(w.lock);
+                  fds.swap(w.pending);
+               }
+               for (int fd : fds)
+                  start(w, new Session(fd, runner, mStackSize));
+            } else if (tag == &mListen) {
+               for (int fd; (fd = accept4(mListen, NULL, NULL, SOCK_CLOEXEC)) >= 0; )
+                  add(fd);
+            } else {
+               Session * s = (Session *)tag;
+               if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                  s->fill();
+                  if (s->waiting()) s->resume();
+               }
+               if (s->writing() && s->drained()) s->resume();
+               finish(w, s);
+            }
+         }
+      }
+   }
+
+public:
+   SessionServer(RunnerFactory factory, unsigned threads, size_t stackSize = Fiber::DefaultStackSize)
+      : mFactory(factory), mStackSize(stackSize), mNext(0), mStopping(false), mActive(0), mPeak(0), mListen(-1) {
+      if (threads == 0) threads = 1;
+      for (unsigned i = 0; i < threads; ++ i) {
+         Worker * w = new Worker();
+         w->epoll = epoll_create1(EPOLL_CLOEXEC);
+         w->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+         epoll_event ev;
+         ev.events = EPOLLIN;
+         ev.data.ptr = w;
+         epoll_ctl(w->epoll, EPOLL_CTL_ADD, w->wake, &ev);
+         mWorkers.push_back(std::unique_ptr<Worker>(w));
+      }
+      for (auto & w : mWorkers) {
+         Worker * wp = w.get();
+         w->thread = std::thread([this, wp]() { loop(*wp); });
+      }
+   }
+   ~SessionServer() {
+      stop();
+      if (mListen >= 0) ::close(mListen);
+   }
+
+   /// Accept connections on a unix socket at \p path, handled by worker 0
+   bool listen(const char * path) {
+      sockaddr_un addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+      unlink(path);
+      mListen = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      if (mListen < 0 || bind(mListen, (sockaddr *)&addr, sizeof(addr)) != 0 ||
+          ::listen(mListen, SOMAXCONN) != 0)
+         return false;
+      epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.ptr = &mListen;
+      return epoll_ctl(mWorkers[0]->epoll, EPOLL_CTL_ADD, mListen, &ev) == 0;
+   }
+
+   /// Hand a connected socket to a worker, round robin
+   void add(int fd) {
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+      long active = ++ mActive;
+      for (long peak = mPeak; active > peak && !mPeak.compare_exchange_weak(peak, active); );
+      Worker & w = *mWorkers[mNext++ % mWorkers.size()];
+      {
+         std::lock_guard<std::mutex> guard(w.lock);
+         w.pending.push_back(fd);
+      }
+      uint64_t one = 1;
+      if (::write(w.wake, &one, sizeof(one)) < 0) {}
+   }
+
+   long active() const {
+      return mActive;
+   }
+   long peak() const {
+      return mPeak;
+   }
+
+   /// Let running sessions finish, then join the workers
+   void stop() {
+      mStopping = true;
+      for (auto & w : mWorkers) {
+         if (w->thread.joinable()) w->thread.join();
+         ::close(w->epoll);
+         ::close(w->wake);
+      }
+      mWorkers.clear();
+   }
+};
+
+/// Stress test: open \p count sessions over socketpairs, all suspended in
+/// GET at once, then feed each of them \p rounds values ("1" each) and close
+/// the input. Returns the output of every session, in creation order.
+inline std::vector<std::string> stressSessions(SessionServer & server, unsigned count, unsigned rounds) {
+   rlimit limit;
+   if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < 2 * count + 64) {
+      limit.rlim_cur = std::min<rlim_t>(limit.rlim_max, 2 * count + 64);
+      setrlimit(RLIMIT_NOFILE, &limit);
+   }
+   std::vector<int> clients;
+   for (unsigned i = 0; i < count; ++ i) {
+      int fds[2];
+      if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) break;
+      clients.push_back(fds[0]);
+      server.add(fds[1]);
+   }
+   for (unsigned r = 0; r < rounds; ++ r)
+      for (int fd : clients)
+         if (::write(fd, "1\n", 2) < 0) {}
+   for (int fd : clients)
+      shutdown(fd, SHUT_WR);
+   std::vector<std::string> outputs;
+   for (int fd : clients) {
+      std::string out;
+      char buf[4096];
+      for (ssize_t n; (n = ::read(fd, buf, sizeof(buf))) != 0; ) {
+         if (n > 0) out.append(buf, n);
+         else if (errno != EINTR) break;
+      }
+      ::close(fd);
+      outputs.push_back(out);
+   }
+   return outputs;
+}
+
+#endif
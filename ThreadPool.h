@@ -0,0 +1,125 @@
+//==--- ThreadPool.h - Work-stealing pool for parallel loop chunks --------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_THREADPOOL_H
+#define AST_INTERPRETER_THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// A fixed set of threads, each with its own task deque. A thread pops from
+/// the back of its own deque and steals from the front of the others when
+/// it runs dry, so uneven chunks balance out. The thread calling run() takes
+/// part as worker 0 until the whole batch is done. Only one batch runs at a
+/// time.
+class WorkStealingPool {
+   struct Queue {
+      std::mutex lock;
+      std::deque<std::function<void()>> tasks;
+   };
+
+   std::vector<std::unique_ptr<Queue>> mQueues;
+   std::vector<std::thread> mThreads;
+   std::mutex mLock;
+   std::condition_variable mWake;      /// tasks were queued, or stopping
+   std::condition_variable mDone;      /// the batch finished
+   std::atomic<long> mQueued;          /// tasks sitting in some deque
+   std::atomic<long> mPending;         /// tasks of the batch not yet finished
+   bool mStop;
+
+   bool pop(unsigned self, std::function<void()> & task) {
+      {
+         Queue & own = *mQueues[self];
+         std::lock_guard<std::mutex> guard(own.lock);
+         if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            -- mQueued;
+            return true;
+         }
+      }
+      for (size_t i = 1; i < mQueues.size(); ++ i) {
+         Queue & victim = *mQueues[(self + i) % mQueues.size()];
+         std::lock_guard<std::mutex> guard(victim.lock);
+         if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            -- mQueued;
+            return true;
+         }
+      }
+      return false;
+   }
+
+   void execute(std::function<void()> & task) {
+      task();
+      if (-- mPending == 0) {
+         std::lock_guard<std::mutex> guard(mLock);
+         mDone.notify_all();
+      }
+   }
+
+   void loop(unsigned self) {
+      std::function<void()> task;
+      for (;;) {
+         if (pop(self, task)) {
+            execute(task);
+            continue;
+         }
+         std::unique_lock<std::mutex> guard(mLock);
+         mWake.wait(guard, [this]() { return mStop || mQueued > 0; });
+         if (mStop) return;
+      }
+   }
+
+public:
+   explicit WorkStealingPool(unsigned threads) : mQueued(0), mPending(0), mStop(false) {
+      if (threads == 0) threads = 1;
+      for (unsigned i = 0; i < threads; ++ i)
+         mQueues.push_back(std::unique_ptr<Queue>(new Queue()));
+      for (unsigned i = 1; i < threads; ++ i)
+         mThreads.push_back(std::thread([this, i]() { loop(i); }));
+   }
+   ~WorkStealingPool() {
+      {
+         std::lock_guard<std::mutex> guard(mLock);
+         mStop = true;
+      }
+      mWake.notify_all();
+      for (auto & thread : mThreads) thread.join();
+   }
+
+   unsigned size() const {
+      return mQueues.size();
+   }
+
+   /// Run every task of \p tasks and return once all of them have finished.
+   /// Tasks must not throw.
+   void run(std::vector<std::function<void()>> & tasks) {
+      if (tasks.empty()) return;
+      mPending = tasks.size();
+      for (size_t i = 0; i < tasks.size(); ++ i) {
+         Queue & q = *mQueues[i % mQueues.size()];
+         std::lock_guard<std::mutex> guard(q.lock);
+         q.tasks.push_back(std::move(tasks[i]));
+      }
+      {
+         std::lock_guard<std::mutex> guard(mLock);
+         mQueued += tasks.size();
+      }
+      mWake.notify_all();
+
+      std::function<void()> task;
+      while (pop(0, task))
+         execute(task);
+      std::unique_lock<std::mutex> guard(mLock);
+      mDone.wait(guard, [this]() { return mPending == 0; });
+   }
+};
+
+#endif
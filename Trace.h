@@ -0,0 +1,210 @@
+//==--- Trace.h - Binary execution trace for the AST interpreter ----------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_TRACE_H
+#define AST_INTERPRETER_TRACE_H
+
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// Kinds of events recorded in a trace
+enum TraceKind : uint32_t {
+   TR_Stmt = 1,    /// loc = statement passed to setPC
+   TR_Call,        /// loc = call site, a = raw location of the callee
+   TR_Return,      /// loc = call site, a = returned value
+   TR_Malloc,      /// loc = call site, a = size, b = address
+   TR_Free,        /// loc = call site, a = address, b = size
+   TR_Print,       /// loc = call site, a = value
+   TR_Get          /// loc = call site, a = value
+};
+
+/// One fixed-size trace record. Source locations are stored as raw
+/// clang::SourceLocation encodings, which are stable across parses of the
+/// same program text, so the decoder can map them back by re-parsing.
+struct TraceRecord {
+   uint32_t kind;
+   uint32_t loc;
+   int64_t a;
+   int64_t b;
+};
+
+/// The trace file is this header followed by `capacity` records used as a
+/// ring buffer. `head` counts every record ever written, so the oldest
+/// surviving record is at max(head - capacity, 0).
+///
+/// After the ring comes the input section: every value GET returned, in
+/// order. It never wraps; the file grows instead, so a replay always has
+/// all of them. `inputsLost` is set if growing the file ever failed.
+struct TraceHeader {
+   char magic[8];
+   uint64_t capacity;
+   uint64_t head;
+   uint64_t inputCapacity;
+   uint64_t inputCount;
+   uint64_t inputsLost;
+};
+
+static const char TraceMagic[8] = {'A', 'S', 'T', 'T', 'R', 'A', 'C', 'E'};
+
+/// Writes records into an mmap'd ring buffer file. The page cache keeps the
+/// records even if the interpreter dies, and the hot path is a single store
+/// of a record with no formatting.
+class Tracer {
+   int mFd;
+   size_t mMapSize;
+   TraceHeader * mHeader;
+   TraceRecord * mRecords;
+   int64_t * mInputs;
+   uint64_t mMask;
+
+   static const uint64_t InitialInputs = 4096;
+
+   void map(void * base) {
+      mHeader = (TraceHeader *)base;
+      mRecords = (TraceRecord *)(mHeader + 1);
+      mInputs = (int64_t *)(mRecords + mHeader->capacity);
+   }
+
+   /// Double the input section by growing the file and the mapping
+   bool growInputs() {
+      uint64_t inputs = mHeader->inputCapacity * 2;
+      size_t size = sizeof(TraceHeader) + mHeader->capacity * sizeof(TraceRecord) + inputs * sizeof(int64_t);
+      if (ftruncate(mFd, size) != 0) return false;
+      void * base = mremap(mHeader, mMapSize, size, MREMAP_MAYMOVE);
+      if (base == MAP_FAILED) return false;
+      mMapSize = size;
+      map(base);
+      mHeader->inputCapacity = inputs;
+      return true;
+   }
+public:
+   Tracer() : mFd(-1), mMapSize(0), mHeader(NULL), mRecords(NULL), mInputs(NULL), mMask(0) {
+   }
+   ~Tracer() {
+      close();
+   }
+
+   /// Create (or truncate) \p path holding \p capacity records, rounded up
+   /// to a power of two so the ring index is a mask
+   bool open(const char * path, uint64_t capacity) {
+      uint64_t cap = 1;
+      while (cap < capacity) cap <<= 1;
+      mFd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+      if (mFd < 0) return false;
+      mMapSize = sizeof(TraceHeader) + cap * sizeof(TraceRecord) + InitialInputs * sizeof(int64_t);
+      if (ftruncate(mFd, mMapSize) != 0) {
+         close();
+         return false;
+      }
+      void * base = mmap(NULL, mMapSize, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, 0);
+      if (base == MAP_FAILED) {
+         close();
+         return false;
+      }
+      mHeader = (TraceHeader *)base;
+      memcpy(mHeader->magic, TraceMagic, sizeof(TraceMagic));
+      mHeader->capacity = cap;
+      mHeader->head = 0;
+      mHeader->inputCapacity = InitialInputs;
+      mHeader->inputCount = 0;
+      mHeader->inputsLost = 0;
+      map(base);
+      mMask = cap - 1;
+      return true;
+   }
+
+   void close() {
+      if (mHeader) munmap(mHeader, mMapSize);
+      if (mFd >= 0) ::close(mFd);
+      mFd = -1;
+      mHeader = NULL;
+      mRecords = NULL;
+   }
+
+   void emit(uint32_t kind, uint32_t loc, int64_t a = 0, int64_t b = 0) {
+      TraceRecord & r = mRecords[mHeader->head & mMask];
+      r.kind = kind;
+      r.loc = loc;
+      r.a = a;
+      r.b = b;
+      ++ mHeader->head;
+   }
+
+   /// Keep a value returned by GET for replay
+   void input(int64_t val) {
+      if (mHeader->inputCount == mHeader->inputCapacity && !growInputs()) {
+         mHeader->inputsLost = 1;
+         return;
+      }
+      mInputs[mHeader->inputCount ++] = val;
+   }
+};
+
+/// Read-only view of a trace file, iterated oldest record first
+class TraceReader {
+   int mFd;
+   size_t mMapSize;
+   const TraceHeader * mHeader;
+   const TraceRecord * mRecords;
+   const int64_t * mInputs;
+public:
+   TraceReader() : mFd(-1), mMapSize(0), mHeader(NULL), mRecords(NULL), mInputs(NULL) {
+   }
+   ~TraceReader() {
+      if (mHeader) munmap((void *)mHeader, mMapSize);
+      if (mFd >= 0) ::close(mFd);
+   }
+
+   bool open(const char * path) {
+      struct stat st;
+      mFd = ::open(path, O_RDONLY);
+      if (mFd < 0 || fstat(mFd, &st) != 0 || (size_t)st.st_size < sizeof(TraceHeader))
+         return false;
+      mMapSize = st.st_size;
+      void * base = mmap(NULL, mMapSize, PROT_READ, MAP_SHARED, mFd, 0);
+      if (base == MAP_FAILED) return false;
+      mHeader = (const TraceHeader *)base;
+      /// at() masks with capacity - 1, and a foreign or truncated file must
+      /// not make the section sizes overflow past the end of the mapping
+      uint64_t capacity = mHeader->capacity, inputs = mHeader->inputCapacity;
+      size_t room = mMapSize - sizeof(TraceHeader);
+      if (memcmp(mHeader->magic, TraceMagic, sizeof(TraceMagic)) != 0 ||
+          capacity == 0 || (capacity & (capacity - 1)) != 0 ||
+          capacity > room / sizeof(TraceRecord) ||
+          inputs > (room - capacity * sizeof(TraceRecord)) / sizeof(int64_t) ||
+          mHeader->inputCount > inputs)
+         return false;
+      mRecords = (const TraceRecord *)(mHeader + 1);
+      mInputs = (const int64_t *)(mRecords + capacity);
+      return true;
+   }
+
+   /// True if older records were overwritten and the trace is incomplete
+   bool wrapped() const {
+      return mHeader->head > mHeader->capacity;
+   }
+   uint64_t begin() const {
+      return wrapped() ? mHeader->head - mHeader->capacity : 0;
+   }
+   uint64_t end() const {
+      return mHeader->head;
+   }
+   const TraceRecord & at(uint64_t i) const {
+      return mRecords[i & (mHeader->capacity - 1)];
+   }
+
+   /// False if some GET values could not be recorded
+   bool inputsComplete() const {
+      return !mHeader->inputsLost;
+   }
+   /// The values returned by GET, in order, for replay
+   std::deque<int64_t> inputs() const {
+      return std::deque<int64_t>(mInputs, mInputs + mHeader->inputCount);
+   }
+};
+
+#endif
@@ -0,0 +1,30 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int work(int x) {
+   int k = 0;
+   int s = 0;
+   while (k < 2000) {
+      s = s + x * k;
+      k = k + 1;
+   }
+   return s;
+}
+int main() {
+   int n = 512;
+   int *a;
+   int i = 0;
+   int j = 0;
+   int sum = 0;
+   a = (int*)MALLOC(sizeof(int)*n);
+   for (i = 0; i < n; i = i + 1) {
+      a[i] = work(i);
+   }
+   for (j = 0; j < n; j = j + 1) {
+      sum = sum + a[j];
+   }
+   PRINT(sum);
+   FREE(a);
+}
@@ -0,0 +1,18 @@
+#!/bin/sh
+# Time bench/parallel_loop.c with --threads 1..N and report the speedup
+# over one thread. Usage: parallel_speedup.sh [ast-interpreter] [N]
+BIN=${1:-./build/ast-interpreter}
+MAX=${2:-$(nproc)}
+CODE=$(cat "$(dirname "$0")/parallel_loop.c")
+
+base=""
+t=1
+while [ "$t" -le "$MAX" ]; do
+   start=$(date +%s.%N)
+   out=$("$BIN" "$CODE" --threads "$t" 2>&1)
+   end=$(date +%s.%N)
+   secs=$(awk "BEGIN { print $end - $start }")
+   [ -z "$base" ] && base=$secs
+   printf "threads %2d  %8.3fs  speedup %5.2fx  output %s\n" "$t" "$secs" "$(awk "BEGIN { print $base / $secs }")" "$out"
+   t=$((t + 1))
+done
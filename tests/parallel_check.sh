@@ -0,0 +1,16 @@
+#!/bin/sh
+# Check that tests/test22.c prints the same with --threads N as it does
+# sequentially. It covers an array write with a + reduction, a * reduction,
+# a loop that must stay sequential because its arrays alias, and a loop
+# with a body-local array. Usage: parallel_check.sh [ast-interpreter] [N]
+BIN=${1:-./build/ast-interpreter}
+THREADS=${2:-4}
+CODE=$(cat "$(dirname "$0")/test22.c")
+
+expected=$("$BIN" "$CODE" 2>&1)
+actual=$("$BIN" "$CODE" --threads "$THREADS" 2>&1)
+if [ "$expected" != "$actual" ]; then
+   printf "FAIL: --threads %s printed\n%s\nsequential run printed\n%s\n" "$THREADS" "$actual" "$expected"
+   exit 1
+fi
+printf "ok: --threads %s matches the sequential run: %s\n" "$THREADS" "$actual"
@@ -0,0 +1,27 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int n = 3;
+int base = -n * 2;
+int g[3];
+int primes[4] = {2, 3, 5};
+int scaled[2] = {n, n * 2};
+
+void fill(int x) {
+   int i = 0;
+   for (; i < n; i = i + 1) {
+      g[i] = base + x + i;
+   }
+   base = base + 1;
+}
+int main() {
+   fill(10);
+   fill(10);
+   PRINT(g[0]);
+   PRINT(g[2]);
+   PRINT(base);
+   PRINT(primes[2] + primes[3]);
+   PRINT(scaled[1]);
+}
@@ -0,0 +1,26 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int depth(int n) {
+   int a[4];
+   int r = 0;
+   a[0] = n;
+   if (n > 0) r = depth(n - 1);
+   PRINT(a[0]);
+   return r + a[0] + a[3];
+}
+/* Run with --mem-limit 256K: b takes 528K if each iteration gets a new block */
+int main() {
+   int i = 0;
+   int stale = 0;
+   while (i < 1000) {
+      int b[64];
+      stale = stale + b[63];
+      b[63] = i + 1;
+      i = i + 1;
+   }
+   PRINT(stale);
+   PRINT(depth(5));
+}
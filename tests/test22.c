@@ -0,0 +1,55 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int main() {
+   int n = 1000;
+   int m = 999;
+   int i = 0;
+   int sum = 0;
+   int prod = 1;
+   int total = 0;
+   int *a;
+   int *b;
+   int *c;
+   a = (int*)MALLOC(sizeof(int)*n);
+   c = (int*)MALLOC(sizeof(int)*n);
+   b = a + 1;
+
+   i = 0;
+   for (i = 0; i < n; i = i + 1) {
+      a[i] = i * 3;
+      sum = sum + a[i];
+   }
+   PRINT(sum);
+
+   i = 0;
+   for (i = 0; i < 20; i = i + 1) {
+      prod = prod * 2;
+   }
+   PRINT(prod);
+
+   a[0] = 7;
+   i = 0;
+   for (i = 0; i < m; i = i + 1) {
+      b[i] = a[i] + 1;
+   }
+   PRINT(a[m]);
+
+   i = 0;
+   for (i = 0; i < n; i = i + 1) {
+      int t[2];
+      t[0] = i;
+      t[1] = t[0] * 2;
+      c[i] = t[0] + t[1];
+   }
+   i = 0;
+   for (i = 0; i < n; i = i + 1) {
+      total = total + c[i];
+   }
+   PRINT(total);
+   PRINT(i);
+   FREE(a);
+   FREE(c);
+}